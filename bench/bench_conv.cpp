@@ -0,0 +1,138 @@
+/*
+ * Benchmarks the FixedPt conv2d algorithms against a float reference
+ * convolution on some common layer shapes.
+ * The float reference is a direct NHWC convolution (the same loop nest as
+ * the fixed point direct kernel) with the channel reduction split into 16
+ * partial sums so it vectorizes without -ffast-math, run on the same number
+ * of threads as the fixed point kernels. It is a fair baseline for the
+ * direct kernel, not a tuned float library (no im2col/GEMM or Winograd).
+ * Compile with: C++17 required: (assuming you're in the bench directory)
+ * * g++: g++-7 -O3 -march=native -I../include -o bench_conv bench_conv.cpp -std=c++1z -pthread
+ * Usage: ./bench_conv [threads]   (default: all hardware threads)
+ */
+#include <iostream>
+#include <iomanip>
+#include <fixedpt_conv.hpp>
+#include <chrono>
+#include <vector>
+#include <string>
+#include <cstdlib>
+#include <math.h>
+using namespace FPMath;
+
+struct Shape {
+   const char* name;
+   int H, W, C, K, R, S, stride, pad;
+};
+
+// NHWC / KRSC float convolution, same loop nest as the direct fixed point
+// kernel, threaded over output rows the same way
+void conv_float(const std::vector<float>& in, const std::vector<float>& wt,
+                std::vector<float>& out, const Shape& s, int OH, int OW,
+                unsigned threads){
+   constexpr int LANES = 16;
+   detail::parallel_for(std::size_t(OH), threads, [&](std::size_t b, std::size_t e){
+      for(int oy = int(b); oy < int(e); ++oy)
+      for(int ox = 0; ox < OW; ++ox)
+      for(int k = 0; k < s.K; ++k){
+         float part[LANES] = {};
+         float tail = 0.0f;
+         for(int r = 0; r < s.R; ++r){
+            int iy = oy*s.stride - s.pad + r;
+            if(iy < 0 || iy >= s.H) continue;
+            for(int q = 0; q < s.S; ++q){
+               int ix = ox*s.stride - s.pad + q;
+               if(ix < 0 || ix >= s.W) continue;
+               const float* ip = &in[(std::size_t(iy)*s.W + ix)*s.C];
+               const float* wp = &wt[((std::size_t(k)*s.R + r)*s.S + q)*s.C];
+               int c = 0;
+               for(; c + LANES <= s.C; c += LANES)
+                  for(int l = 0; l < LANES; ++l)
+                     part[l] += ip[c+l] * wp[c+l];
+               for(; c < s.C; ++c)
+                  tail += ip[c] * wp[c];
+            }
+         }
+         for(int l = 0; l < LANES; ++l)
+            tail += part[l];
+         out[(std::size_t(oy)*OW + ox)*s.K + k] = tail;
+      }
+   });
+}
+
+template<typename F>
+double time_ms(F&& fn, int reps){
+   fn(); // warm up
+   auto start = std::chrono::steady_clock::now();
+   for(int i = 0; i < reps; ++i)
+      fn();
+   auto stop = std::chrono::steady_clock::now();
+   return std::chrono::duration<double, std::milli>(stop - start).count() / reps;
+}
+
+int main(int argc, char** argv){
+   unsigned threads = argc > 1 ? unsigned(std::atoi(argv[1])) : 0;
+   constexpr uint8_t in_f = 8, wt_f = 12, out_f = 8;
+
+   const Shape shapes[] = {
+      {"resnet conv2_x 3x3",  56, 56,  64,  64, 3, 3, 1, 1},
+      {"resnet conv3_x 3x3",  28, 28, 128, 128, 3, 3, 1, 1},
+      {"resnet conv4_x 3x3",  14, 14, 256, 256, 3, 3, 1, 1},
+      {"resnet 1x1 expand",   28, 28, 128, 512, 1, 1, 1, 0},
+      {"resnet 3x3 stride 2", 56, 56,  64, 128, 3, 3, 2, 1},
+      {"mobilenet stem 3x3", 112,112,   3,  32, 3, 3, 2, 1},
+      {"5x5 small channels",  32, 32,  16,  32, 5, 5, 1, 2},
+   };
+
+   std::srand(1);
+   std::cout << std::fixed << std::setprecision(2);
+   for(const auto& s : shapes){
+      FixedTensor<8,in_f,true> in(1, s.H, s.W, s.C);
+      FixedTensor<4,wt_f,true> wt(s.K, s.R, s.S, s.C);
+      std::vector<float> fin(in.size()), fwt(wt.size());
+      for(std::size_t i = 0; i < in.size(); ++i){
+         in.data[i].val = std::rand() % 512 - 256;
+         fin[i] = float(in.data[i].val) / (1 << in_f);
+      }
+      for(std::size_t i = 0; i < wt.size(); ++i){
+         wt.data[i].val = std::rand() % 1024 - 512;
+         fwt[i] = float(wt.data[i].val) / (1 << wt_f);
+      }
+      const int OH = (s.H + 2*s.pad - s.R) / s.stride + 1;
+      const int OW = (s.W + 2*s.pad - s.S) / s.stride + 1;
+      std::vector<float> fout(std::size_t(OH)*OW*s.K);
+      const double gmacs = double(OH)*OW*s.K*s.R*s.S*s.C / 1e9;
+      const int reps = gmacs > 0.2 ? 2 : 5;
+
+      std::cout << s.name << ": " << s.H << "x" << s.W << "x" << s.C << " -> "
+                << OH << "x" << OW << "x" << s.K << " (" << s.R << "x" << s.S
+                << ", stride " << s.stride << ", " << gmacs << " GMAC)" << std::endl;
+      double t = time_ms([&]{ conv_float(fin, fwt, fout, s, OH, OW, threads); }, reps);
+      std::cout << "   float reference: " << std::setw(9) << t << " ms" << std::endl;
+
+      Conv2dParams p;
+      p.stride_h = p.stride_w = s.stride;
+      p.pad_h = p.pad_w = s.pad;
+      p.threads = threads;
+      const std::pair<ConvAlgo, const char*> algos[] = {
+         {ConvAlgo::Direct, "direct"}, {ConvAlgo::Im2col, "im2col"},
+         {ConvAlgo::Winograd, "winograd"}, {ConvAlgo::Auto, "auto"}};
+      for(const auto& a : algos){
+         if(a.first == ConvAlgo::Winograd && (s.R != 3 || s.S != 3 || s.stride != 1)){
+            // conv2d would silently run the Auto choice instead
+            std::cout << "   fixed " << std::left << std::setw(10) << a.second << std::right
+                      << std::setw(9) << "n/a" << std::endl;
+            continue;
+         }
+         p.algo = a.first;
+         FixedTensor<16,out_f,true> out;
+         t = time_ms([&]{ out = conv2d<16,out_f,true>(in, wt, p); }, reps);
+         double max_err = 0.0;
+         for(std::size_t i = 0; i < out.size(); ++i)
+            max_err = std::max(max_err, fabs(double(out.data[i].val) / (1 << out_f) - fout[i]));
+         std::cout << "   fixed " << std::left << std::setw(10) << a.second << std::right
+                   << std::setw(9) << t << " ms   max err vs float: "
+                   << std::setprecision(5) << max_err << std::setprecision(2) << std::endl;
+      }
+   }
+}
@@ -0,0 +1,477 @@
+/*********************************************************************************
+ * fixedpt_conv.hpp
+ * Description:
+ * 2D convolution over tensors of FixedPts, NHWC layout.
+ *
+ * Chaining scalar FixedPt operator* / operator+ calls saturates (and shifts)
+ * at every multiply-accumulate. These kernels instead pull the raw integer
+ * values out of the bitfields once, accumulate the products in an int64_t
+ * (which carries IN_FRAC+W_FRAC fractional bits) and requantize exactly once
+ * into the output FixedPt format.
+ *
+ * Three interchangeable algorithms, bit-exact with each other as long as
+ * none of them overflows (see Limitations):
+ * * Direct   - nested loops, compile-time unrolled for 1x1, 3x3 and 5x5 filters.
+ * * Im2col   - unrolls tiles of output pixels into rows and feeds a blocked
+ *              integer GEMM against the (K x R*S*C) weight matrix.
+ *              1x1/stride 1/no pad convolutions skip the copy entirely.
+ * * Winograd - F(2x2,3x3) for 3x3, stride 1, dilation 1 filters. Weights are
+ *              transformed with 2*G so everything stays integral; the 4x
+ *              scale is divided out exactly before requantizing.
+ * Work is split over output rows/tiles with std::thread (link with -pthread).
+ *
+ * Layouts:
+ * * input   : N x H x W x C
+ * * weights : K x R x S x C (out channels, filter height, filter width, in channels)
+ * * output  : N x OH x OW x K
+ *
+ * Limitations:
+ * * Input and weight FixedPts must fit in an int32_t (<= 31 bits unsigned,
+ *   <= 32 bits signed) and the output must be narrower than 64 bits.
+ * * The int64_t accumulator is not checked for overflow; with 16 bit
+ *   operands that leaves room for ~2^31 accumulated terms in the direct and
+ *   im2col kernels. Winograd's transformed weights are up to 9x and its
+ *   transformed inputs up to 4x larger than the raw values, and the output
+ *   transform adds another 9x, so with 16 bit operands it only has room for
+ *   ~2^22 input channels. ConvAlgo::Auto only picks Winograd when the
+ *   operand widths and channel count leave enough headroom.
+ * * Bad shapes (zero or mismatched channel counts, no output channels,
+ *   filter window larger than the padded input, non-positive
+ *   stride/dilation) throw std::invalid_argument.
+ *   A requested algorithm that does not apply to the shape, or (for
+ *   Winograd) could overflow on it, falls back to the ConvAlgo::Auto choice.
+ */
+#ifndef FIXEDPT_CONV_HPP_INCLUDED
+#define FIXEDPT_CONV_HPP_INCLUDED
+#include <fixedpt.hpp>
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include <thread>
+#include <algorithm>
+#include <stdexcept>
+
+namespace FPMath {
+
+// A 4D tensor of FixedPts. For activations the dimensions are N,H,W,C;
+// for weights the same fields hold K,R,S,C.
+template< uint8_t WWIDTH, uint8_t FRACWIDTH, bool Signed=false>
+struct FixedTensor {
+   using elem_t = FixedPt<WWIDTH, FRACWIDTH, Signed>;
+
+   std::size_t n, h, w, c;
+   std::vector<elem_t> data;
+
+   FixedTensor() : n(0), h(0), w(0), c(0) { }
+
+   FixedTensor(std::size_t n_, std::size_t h_, std::size_t w_, std::size_t c_) :
+      n(n_), h(h_), w(w_), c(c_), data(n_*h_*w_*c_) { }
+
+   std::size_t size() const { return data.size(); }
+
+   std::size_t index(std::size_t in, std::size_t ih, std::size_t iw, std::size_t ic) const {
+      return ((in*h + ih)*w + iw)*c + ic;
+   }
+
+   elem_t& at(std::size_t in, std::size_t ih, std::size_t iw, std::size_t ic) {
+      return data[index(in, ih, iw, ic)];
+   }
+
+   const elem_t& at(std::size_t in, std::size_t ih, std::size_t iw, std::size_t ic) const {
+      return data[index(in, ih, iw, ic)];
+   }
+};
+
+enum class ConvAlgo { Auto, Direct, Im2col, Winograd };
+
+struct Conv2dParams {
+   int stride_h   = 1;
+   int stride_w   = 1;
+   int pad_h      = 0;
+   int pad_w      = 0;
+   int dilation_h = 1;
+   int dilation_w = 1;
+   // 0 means use std::thread::hardware_concurrency()
+   unsigned threads = 0;
+   ConvAlgo algo    = ConvAlgo::Auto;
+};
+
+namespace detail {
+
+// Sizes and strides shared by all of the kernels.
+struct ConvShape {
+   int N, H, W, C;   // input
+   int K, R, S;      // weights (C shared with input)
+   int OH, OW;       // output
+   int sh, sw, ph, pw, dh, dw;
+   int shift;        // right shift taking the accumulator to the output fraction width
+};
+
+// Saturating (if SAT) round-half-up conversion of a wide accumulator into
+// the raw value of an output FixedPt.
+template< uint8_t WWIDTH, uint8_t FRACWIDTH, bool Signed>
+struct Requantize {
+   static constexpr int BITS = WWIDTH + FRACWIDTH;
+   static_assert(BITS < 64, "conv2d output FixedPt must be narrower than 64 bits");
+   static constexpr int64_t lo = Signed ? -(int64_t(1) << (BITS-1))   : 0;
+   static constexpr int64_t hi = Signed ?  (int64_t(1) << (BITS-1))-1 : (int64_t(1) << BITS)-1;
+
+   static int64_t apply(int64_t acc, int shift) {
+      if(shift >= 64) {
+         // |acc| < 2^63, so acc/2^shift rounds to 0
+         acc = 0;
+      } else if(shift > 0) {
+         // floor(acc/2^shift + 1/2) without the overflowing acc + half
+         acc = (acc >> shift) + ((acc >> (shift-1)) & 1);
+      } else if(shift < 0) {
+         // saturate before shifting left so the shift cannot overflow
+         if(SAT && acc > (hi >> -shift))
+            return hi;
+         if(SAT && acc < (lo >> -shift))
+            return lo;
+         acc = int64_t(uint64_t(acc) << -shift);
+      }
+      if(SAT)
+         acc = std::min(std::max(acc, lo), hi);
+      return acc;
+   }
+};
+
+// Copy the raw bitfield values out of a tensor once so the kernels work on
+// plain integers (signed bitfields sign-extend on read).
+template< uint8_t WWIDTH, uint8_t FRACWIDTH, bool Signed>
+std::vector<int32_t> to_raw(const FixedTensor<WWIDTH, FRACWIDTH, Signed>& t) {
+   static_assert(WWIDTH + FRACWIDTH <= (Signed ? 32 : 31),
+                 "conv2d operands must fit in an int32_t");
+   std::vector<int32_t> raw(t.size());
+   for(std::size_t i = 0; i < t.size(); ++i)
+      raw[i] = static_cast<int32_t>(t.data[i].val);
+   return raw;
+}
+
+// Split `count` work items into one contiguous [begin,end) range per thread.
+// fn is called exactly once per thread, so scratch buffers it allocates up
+// front are per-thread rather than per work item.
+template<typename F>
+void parallel_for(std::size_t count, unsigned threads, F&& fn) {
+   if(threads == 0)
+      threads = std::max(1u, std::thread::hardware_concurrency());
+   threads = unsigned(std::min<std::size_t>(threads, count));
+   if(threads <= 1) {
+      if(count > 0)
+         fn(std::size_t(0), count);
+      return;
+   }
+   auto range = [&](unsigned t) { return count * t / threads; };
+   std::vector<std::thread> pool;
+   for(unsigned t = 1; t < threads; ++t)
+      pool.emplace_back([&fn, b = range(t), e = range(t+1)]() { fn(b, e); });
+   fn(range(0), range(1));
+   for(auto& th : pool)
+      th.join();
+}
+
+// Direct convolution of one output row. KR/KS > 0 fix the filter size at
+// compile time so the r/s loops unroll; 0 falls back to the runtime size.
+template<int KR, int KS, typename OutTensor, typename Quant>
+void direct_row(const ConvShape& sh, const int32_t* in, const int32_t* wt,
+                OutTensor& out, int n, int oy) {
+   const int R = KR > 0 ? KR : sh.R;
+   const int S = KS > 0 ? KS : sh.S;
+   const int C = sh.C;
+   for(int ox = 0; ox < sh.OW; ++ox) {
+      auto* op = &out.data[out.index(n, oy, ox, 0)];
+      for(int k = 0; k < sh.K; ++k) {
+         int64_t acc = 0;
+         for(int r = 0; r < R; ++r) {
+            const int iy = oy*sh.sh - sh.ph + r*sh.dh;
+            if(iy < 0 || iy >= sh.H) continue;
+            for(int s = 0; s < S; ++s) {
+               const int ix = ox*sh.sw - sh.pw + s*sh.dw;
+               if(ix < 0 || ix >= sh.W) continue;
+               const int32_t* ip = in + ((std::size_t(n)*sh.H + iy)*sh.W + ix)*C;
+               const int32_t* wp = wt + ((std::size_t(k)*R + r)*S + s)*C;
+               for(int c = 0; c < C; ++c)
+                  acc += int64_t(ip[c]) * wp[c];
+            }
+         }
+         op[k].val = Quant::apply(acc, sh.shift);
+      }
+   }
+}
+
+template<typename OutTensor, typename Quant>
+void conv_direct(const ConvShape& sh, const int32_t* in, const int32_t* wt,
+                 OutTensor& out, unsigned threads) {
+   auto row = &direct_row<0, 0, OutTensor, Quant>;
+   if(sh.R == 1 && sh.S == 1)      row = &direct_row<1, 1, OutTensor, Quant>;
+   else if(sh.R == 3 && sh.S == 3) row = &direct_row<3, 3, OutTensor, Quant>;
+   else if(sh.R == 5 && sh.S == 5) row = &direct_row<5, 5, OutTensor, Quant>;
+   parallel_for(std::size_t(sh.N)*sh.OH, threads, [&](std::size_t b, std::size_t e) {
+      for(std::size_t i = b; i < e; ++i)
+         row(sh, in, wt, out, int(i / sh.OH), int(i % sh.OH));
+   });
+}
+
+// im2col + blocked GEMM. Each work item is a block of IM2COL_MB output
+// pixels; its rows of the column matrix are built in a per-thread buffer
+// (reused for every block the thread handles) so the full
+// (N*OH*OW x R*S*C) matrix is never materialized.
+constexpr int IM2COL_MB = 64;   // output pixels per block
+constexpr int GEMM_NB   = 16;   // output channels per block
+constexpr int GEMM_KB   = 256;  // reduction length per block
+
+template<typename OutTensor, typename Quant>
+void conv_im2col(const ConvShape& sh, const int32_t* in, const int32_t* wt,
+                 OutTensor& out, unsigned threads) {
+   const std::size_t KD     = std::size_t(sh.R)*sh.S*sh.C;
+   const std::size_t pixels = std::size_t(sh.N)*sh.OH*sh.OW;
+   const std::size_t blocks = (pixels + IM2COL_MB - 1) / IM2COL_MB;
+   // a 1x1, stride 1, unpadded conv is already a GEMM over the input rows
+   const bool pointwise = sh.R == 1 && sh.S == 1 && sh.sh == 1 && sh.sw == 1 &&
+                          sh.ph == 0 && sh.pw == 0;
+
+   parallel_for(blocks, threads, [&](std::size_t b, std::size_t e) {
+      std::vector<int32_t> col(pointwise ? 0 : IM2COL_MB*KD);
+      const int32_t* rows[IM2COL_MB];
+      int64_t acc[IM2COL_MB][GEMM_NB];
+      for(std::size_t blk = b; blk < e; ++blk) {
+         const std::size_t p0 = blk*IM2COL_MB;
+         const int mb = int(std::min<std::size_t>(IM2COL_MB, pixels - p0));
+
+         for(int p = 0; p < mb; ++p) {
+            const std::size_t pix = p0 + p;
+            if(pointwise) {
+               rows[p] = in + pix*sh.C;
+               continue;
+            }
+            const int n  = int(pix / (std::size_t(sh.OH)*sh.OW));
+            const int oy = int(pix / sh.OW % sh.OH);
+            const int ox = int(pix % sh.OW);
+            int32_t* dst = &col[p*KD];
+            for(int r = 0; r < sh.R; ++r) {
+               const int iy = oy*sh.sh - sh.ph + r*sh.dh;
+               for(int s = 0; s < sh.S; ++s, dst += sh.C) {
+                  const int ix = ox*sh.sw - sh.pw + s*sh.dw;
+                  if(iy < 0 || iy >= sh.H || ix < 0 || ix >= sh.W) {
+                     std::fill(dst, dst + sh.C, 0);
+                  } else {
+                     const int32_t* src = in + ((std::size_t(n)*sh.H + iy)*sh.W + ix)*sh.C;
+                     std::copy(src, src + sh.C, dst);
+                  }
+               }
+            }
+            rows[p] = &col[p*KD];
+         }
+
+         for(int k0 = 0; k0 < sh.K; k0 += GEMM_NB) {
+            const int nb = std::min(GEMM_NB, sh.K - k0);
+            for(int p = 0; p < mb; ++p)
+               std::fill(acc[p], acc[p] + nb, 0);
+            for(std::size_t j0 = 0; j0 < KD; j0 += GEMM_KB) {
+               const std::size_t j1 = std::min<std::size_t>(KD, j0 + GEMM_KB);
+               for(int p = 0; p < mb; ++p) {
+                  const int32_t* a = rows[p];
+                  for(int k = 0; k < nb; ++k) {
+                     const int32_t* bw = wt + std::size_t(k0 + k)*KD;
+                     int64_t sum = 0;
+                     for(std::size_t j = j0; j < j1; ++j)
+                        sum += int64_t(a[j]) * bw[j];
+                     acc[p][k] += sum;
+                  }
+               }
+            }
+            for(int p = 0; p < mb; ++p) {
+               auto* op = &out.data[(p0 + p)*sh.K + k0];
+               for(int k = 0; k < nb; ++k)
+                  op[k].val = Quant::apply(acc[p][k], sh.shift);
+            }
+         }
+      }
+   });
+}
+
+// Winograd F(2x2,3x3):  Y = A^T [ (G g G^T) . (B^T d B) ] A
+// G has entries of 1/2, so weights are transformed with 2*G instead and the
+// result (4*Y, exactly) is shifted right by 2 before requantizing.
+inline bool winograd_applies(const ConvShape& sh) {
+   return sh.R == 3 && sh.S == 3 && sh.sh == 1 && sh.sw == 1 &&
+          sh.dh == 1 && sh.dw == 1;
+}
+
+// Whether Winograd's sums are guaranteed to fit in an int64_t: each term
+// is up to 36x a raw product (9x weight, 4x input transform), the output
+// transform adds another 9x (< 2^9 together), and there are C terms.
+inline bool winograd_fits(const ConvShape& sh, int in_bits, int wt_bits) {
+   int c_bits = 0;
+   while((int64_t(1) << c_bits) < sh.C)
+      ++c_bits;
+   return in_bits + wt_bits + 9 + c_bits <= 63;
+}
+
+template<typename OutTensor, typename Quant>
+void conv_winograd(const ConvShape& sh, const int32_t* in, const int32_t* wt,
+                   OutTensor& out, unsigned threads) {
+   const int C = sh.C, K = sh.K;
+
+   // U[k][c][16] = (2G) g (2G)^T
+   std::vector<int64_t> U(std::size_t(K)*C*16);
+   for(int k = 0; k < K; ++k) {
+      for(int c = 0; c < C; ++c) {
+         int64_t g[3][3], t[4][3];
+         for(int r = 0; r < 3; ++r)
+            for(int s = 0; s < 3; ++s)
+               g[r][s] = wt[((std::size_t(k)*3 + r)*3 + s)*C + c];
+         for(int s = 0; s < 3; ++s) {
+            t[0][s] = 2*g[0][s];
+            t[1][s] = g[0][s] + g[1][s] + g[2][s];
+            t[2][s] = g[0][s] - g[1][s] + g[2][s];
+            t[3][s] = 2*g[2][s];
+         }
+         int64_t* u = &U[(std::size_t(k)*C + c)*16];
+         for(int i = 0; i < 4; ++i) {
+            u[i*4 + 0] = 2*t[i][0];
+            u[i*4 + 1] = t[i][0] + t[i][1] + t[i][2];
+            u[i*4 + 2] = t[i][0] - t[i][1] + t[i][2];
+            u[i*4 + 3] = 2*t[i][2];
+         }
+      }
+   }
+
+   const int tiles_y = (sh.OH + 1) / 2;
+   const int tiles_x = (sh.OW + 1) / 2;
+   parallel_for(std::size_t(sh.N)*tiles_y, threads, [&](std::size_t b, std::size_t e) {
+      std::vector<int64_t> V(std::size_t(C)*16);
+      int64_t M[16];
+      for(std::size_t item = b; item < e; ++item) {
+         const int n  = int(item / tiles_y);
+         const int oy = int(item % tiles_y) * 2;
+         for(int tx = 0; tx < tiles_x; ++tx) {
+            const int ox = tx*2;
+
+            // V[c][16] = B^T d B over the zero-padded 4x4 input tile
+            for(int c = 0; c < C; ++c) {
+               int64_t d[4][4], t[4][4];
+               for(int i = 0; i < 4; ++i) {
+                  const int iy = oy - sh.ph + i;
+                  for(int j = 0; j < 4; ++j) {
+                     const int ix = ox - sh.pw + j;
+                     d[i][j] = (iy < 0 || iy >= sh.H || ix < 0 || ix >= sh.W) ? 0 :
+                               in[((std::size_t(n)*sh.H + iy)*sh.W + ix)*C + c];
+                  }
+               }
+               for(int j = 0; j < 4; ++j) {
+                  t[0][j] = d[0][j] - d[2][j];
+                  t[1][j] = d[1][j] + d[2][j];
+                  t[2][j] = d[2][j] - d[1][j];
+                  t[3][j] = d[1][j] - d[3][j];
+               }
+               int64_t* v = &V[std::size_t(c)*16];
+               for(int i = 0; i < 4; ++i) {
+                  v[i*4 + 0] = t[i][0] - t[i][2];
+                  v[i*4 + 1] = t[i][1] + t[i][2];
+                  v[i*4 + 2] = t[i][2] - t[i][1];
+                  v[i*4 + 3] = t[i][1] - t[i][3];
+               }
+            }
+
+            for(int k = 0; k < K; ++k) {
+               std::fill(M, M + 16, 0);
+               const int64_t* u = &U[std::size_t(k)*C*16];
+               for(int c = 0; c < C; ++c)
+                  for(int i = 0; i < 16; ++i)
+                     M[i] += u[c*16 + i] * V[std::size_t(c)*16 + i];
+
+               // Y = A^T M A
+               int64_t t[2][4], y[2][2];
+               for(int j = 0; j < 4; ++j) {
+                  t[0][j] = M[0*4 + j] + M[1*4 + j] + M[2*4 + j];
+                  t[1][j] = M[1*4 + j] - M[2*4 + j] - M[3*4 + j];
+               }
+               for(int i = 0; i < 2; ++i) {
+                  y[i][0] = t[i][0] + t[i][1] + t[i][2];
+                  y[i][1] = t[i][1] - t[i][2] - t[i][3];
+               }
+               for(int i = 0; i < 2 && oy + i < sh.OH; ++i)
+                  for(int j = 0; j < 2 && ox + j < sh.OW; ++j)
+                     out.data[out.index(n, oy + i, ox + j, k)].val =
+                        Quant::apply(y[i][j] >> 2, sh.shift);
+            }
+         }
+      }
+   });
+}
+
+} // namespace detail
+
+// 2D convolution of an NHWC input with KRSC weights. The output FixedPt
+// format is given explicitly, the rest is deduced:
+//    auto out = conv2d<8,8,true>(input, weights, params);
+template< uint8_t OWWID, uint8_t OFWID, bool OSIGNED,
+          uint8_t IWWID, uint8_t IFWID, bool ISIGNED,
+          uint8_t KWWID, uint8_t KFWID, bool KSIGNED>
+auto conv2d(const FixedTensor<IWWID,IFWID,ISIGNED>& input,
+            const FixedTensor<KWWID,KFWID,KSIGNED>& weights,
+            const Conv2dParams& p = Conv2dParams())
+{
+   using out_t = FixedTensor<OWWID,OFWID,OSIGNED>;
+   using quant = detail::Requantize<OWWID,OFWID,OSIGNED>;
+   if(input.c != weights.c)
+      throw std::invalid_argument("conv2d: input and weight channel counts differ");
+   if(input.c == 0 || weights.n == 0)
+      throw std::invalid_argument("conv2d: input channels and output channels must be non-zero");
+   if(p.stride_h <= 0 || p.stride_w <= 0 || p.dilation_h <= 0 || p.dilation_w <= 0 ||
+      p.pad_h < 0 || p.pad_w < 0)
+      throw std::invalid_argument("conv2d: stride and dilation must be positive, padding non-negative");
+
+   detail::ConvShape sh;
+   sh.N = int(input.n);   sh.H = int(input.h);   sh.W = int(input.w);  sh.C = int(input.c);
+   sh.K = int(weights.n); sh.R = int(weights.h); sh.S = int(weights.w);
+   sh.sh = p.stride_h;    sh.sw = p.stride_w;
+   sh.ph = p.pad_h;       sh.pw = p.pad_w;
+   sh.dh = p.dilation_h;  sh.dw = p.dilation_w;
+   // check before dividing: int division truncates a negative numerator to 0
+   if(sh.R <= 0 || sh.S <= 0 ||
+      sh.H + 2*sh.ph < sh.dh*(sh.R-1) + 1 || sh.W + 2*sh.pw < sh.dw*(sh.S-1) + 1)
+      throw std::invalid_argument("conv2d: filter window does not fit in the padded input");
+   sh.OH = (sh.H + 2*sh.ph - sh.dh*(sh.R-1) - 1) / sh.sh + 1;
+   sh.OW = (sh.W + 2*sh.pw - sh.dw*(sh.S-1) - 1) / sh.sw + 1;
+   sh.shift = int(IFWID) + int(KFWID) - int(OFWID);
+
+   out_t out(input.n, std::size_t(sh.OH), std::size_t(sh.OW), weights.n);
+   const auto in_raw = detail::to_raw(input);
+   const auto wt_raw = detail::to_raw(weights);
+
+   ConvAlgo algo = p.algo;
+   if(algo == ConvAlgo::Winograd &&
+      (!detail::winograd_applies(sh) || !detail::winograd_fits(sh, IWWID+IFWID, KWWID+KFWID)))
+      algo = ConvAlgo::Auto;
+   if(algo == ConvAlgo::Auto) {
+      // picked from bench/bench_conv.cpp: Winograd wins once there are
+      // enough channels and tiles to amortize the transforms, the direct
+      // kernel wins on pointwise convs, im2col everywhere else
+      if(detail::winograd_applies(sh) && sh.C >= 8 && sh.K >= 8 && sh.OH*sh.OW >= 256 &&
+         detail::winograd_fits(sh, IWWID+IFWID, KWWID+KFWID))
+         algo = ConvAlgo::Winograd;
+      else if(sh.R == 1 && sh.S == 1)
+         algo = ConvAlgo::Direct;
+      else
+         algo = ConvAlgo::Im2col;
+   }
+
+   switch(algo) {
+      case ConvAlgo::Winograd:
+         detail::conv_winograd<out_t, quant>(sh, in_raw.data(), wt_raw.data(), out, p.threads);
+         break;
+      case ConvAlgo::Im2col:
+         detail::conv_im2col<out_t, quant>(sh, in_raw.data(), wt_raw.data(), out, p.threads);
+         break;
+      default:
+         detail::conv_direct<out_t, quant>(sh, in_raw.data(), wt_raw.data(), out, p.threads);
+         break;
+   }
+   return out;
+}
+
+} //namespace FPMath
+#endif //FIXEDPT_CONV_HPP_INCLUDED
@@ -0,0 +1,224 @@
+/*
+ * Compile with: C++17 required: (assuming you're in the test directory)
+ * * g++: g++-7 -I../include -o test_conv test_conv.cpp -std=c++1z -pthread
+ */
+#include <iostream>
+#include <fixedpt_conv.hpp>
+#include <assert.h>
+#include <cstdint>
+#include <cstdlib>
+#include <math.h>
+#include <stdexcept>
+using namespace FPMath;
+
+// fill with random raw values in [lo, hi]
+template<typename T>
+void fill_random(T& t, int lo, int hi){
+   for(auto& e : t.data)
+      e.val = lo + std::rand() % (hi - lo + 1);
+}
+
+template<typename T>
+double raw_to_double(const T& t, std::size_t i, int frac){
+   return double(t.data[i].val) / double(int64_t(1) << frac);
+}
+
+// Run every applicable algorithm on one shape; they must agree bit for bit
+// and be within half an output LSB of a double precision reference.
+void check_shape(int N, int H, int W, int C, int K, int R, int S,
+                 int stride, int pad, int dil){
+   constexpr uint8_t in_f = 8, wt_f = 10, out_f = 6;
+   FixedTensor<4,in_f,true> in(N, H, W, C);
+   FixedTensor<2,wt_f,true> wt(K, R, S, C);
+   fill_random(in, -400, 400);
+   fill_random(wt, -600, 600);
+
+   Conv2dParams p;
+   p.stride_h = p.stride_w = stride;
+   p.pad_h = p.pad_w = pad;
+   p.dilation_h = p.dilation_w = dil;
+   p.threads = 3;
+
+   p.algo = ConvAlgo::Direct;
+   auto direct = conv2d<16,out_f,true>(in, wt, p);
+   p.algo = ConvAlgo::Im2col;
+   auto im2col = conv2d<16,out_f,true>(in, wt, p);
+   assert(direct.n == std::size_t(N) && direct.c == std::size_t(K));
+   assert(direct.h == std::size_t((H + 2*pad - dil*(R-1) - 1)/stride + 1));
+   assert(direct.w == std::size_t((W + 2*pad - dil*(S-1) - 1)/stride + 1));
+   for(std::size_t i = 0; i < direct.size(); ++i)
+      assert(direct.data[i].val == im2col.data[i].val);
+
+   if(R == 3 && S == 3 && stride == 1 && dil == 1){
+      p.algo = ConvAlgo::Winograd;
+      auto wino = conv2d<16,out_f,true>(in, wt, p);
+      for(std::size_t i = 0; i < direct.size(); ++i)
+         assert(direct.data[i].val == wino.data[i].val);
+   }
+
+   //whatever Auto picks for this shape must agree too
+   p.algo = ConvAlgo::Auto;
+   auto automatic = conv2d<16,out_f,true>(in, wt, p);
+   for(std::size_t i = 0; i < direct.size(); ++i)
+      assert(direct.data[i].val == automatic.data[i].val);
+
+   //Winograd on a shape it does not apply to falls back to Auto
+   p.algo = ConvAlgo::Winograd;
+   auto fallback = conv2d<16,out_f,true>(in, wt, p);
+   for(std::size_t i = 0; i < direct.size(); ++i)
+      assert(direct.data[i].val == fallback.data[i].val);
+
+   double max_err = 0.0;
+   for(int n = 0; n < N; ++n)
+   for(std::size_t oy = 0; oy < direct.h; ++oy)
+   for(std::size_t ox = 0; ox < direct.w; ++ox)
+   for(int k = 0; k < K; ++k){
+      double ref = 0.0;
+      for(int r = 0; r < R; ++r)
+      for(int s = 0; s < S; ++s){
+         int iy = int(oy)*stride - pad + r*dil;
+         int ix = int(ox)*stride - pad + s*dil;
+         if(iy < 0 || iy >= H || ix < 0 || ix >= W) continue;
+         for(int c = 0; c < C; ++c)
+            ref += raw_to_double(in, in.index(n,iy,ix,c), in_f) *
+                   raw_to_double(wt, wt.index(k,r,s,c), wt_f);
+      }
+      std::size_t i = direct.index(n,oy,ox,k);
+      max_err = std::max(max_err, fabs(raw_to_double(direct, i, out_f) - ref));
+   }
+   std::cout << "conv " << N << "x" << H << "x" << W << "x" << C << " * "
+             << K << "x" << R << "x" << S << " stride " << stride << " pad " << pad
+             << " dil " << dil << " max err: " << max_err << std::endl;
+   assert(max_err <= 0.5 / (1 << out_f) + 1e-9);
+}
+
+int main(){
+   //1x1 input, 1x1 filter: 1.5 * 2.25 = 3.375
+   FixedTensor<5,3> a(1,1,1,1);
+   FixedTensor<2,4> b(1,1,1,1);
+   a.at(0,0,0,0) = 1.5;
+   b.at(0,0,0,0) = 2.25;
+   auto ab = conv2d<5,4,false>(a, b);
+   std::cout << "ab bits " << ab.at(0,0,0,0).to_bitstring() << std::endl;
+   assert(float(ab.at(0,0,0,0)) == 3.375);
+   assert(ab.at(0,0,0,0).to_bitstring() == "00011.0110");
+
+   //accumulation is wide: intermediate sums exceed the output range but the
+   //final result does not, so nothing saturates
+   FixedTensor<3,3,true> x(1,1,3,1);
+   FixedTensor<3,3,true> y(1,1,3,1);
+   x.at(0,0,0,0).val = 3 << 3;  y.at(0,0,0,0).val =  2 << 3;
+   x.at(0,0,1,0).val = 3 << 3;  y.at(0,0,1,0).val =  2 << 3;
+   x.at(0,0,2,0).val = 3 << 3;  y.at(0,0,2,0).val = -2 * 8;
+   auto xy = conv2d<4,3,true>(x, y);
+   std::cout << "xy bits " << xy.at(0,0,0,0).to_bitstring() << std::endl;
+   assert(float(xy.at(0,0,0,0)) == 6.0);
+
+   //the final result saturates
+   y.at(0,0,2,0).val = 2 << 3;
+   auto xy_sat = conv2d<4,3,true>(x, y);
+   std::cout << "xy_sat bits " << xy_sat.at(0,0,0,0).to_bitstring() << " (should saturate)" << std::endl;
+   assert(xy_sat.at(0,0,0,0).to_bitstring() == "0111.111");
+
+   //unsigned output, negative accumulator: clamps to 0
+   y.at(0,0,0,0).val = -2 * 8;
+   y.at(0,0,1,0).val = -2 * 8;
+   y.at(0,0,2,0).val = -2 * 8;
+   auto xy_neg = conv2d<4,3,false>(x, y);
+   std::cout << "xy_neg bits " << xy_neg.at(0,0,0,0).to_bitstring() << " (should clamp to 0)" << std::endl;
+   assert(xy_neg.at(0,0,0,0).to_bitstring() == "0000.000");
+
+   //output with more fraction bits than the accumulator: the left shift
+   //saturates instead of overflowing
+   FixedTensor<16,0,true> big(1,1,1,1), big_w(1,1,1,1);
+   big.at(0,0,0,0).val = 30000;
+   big_w.at(0,0,0,0).val = 30000;
+   auto big_sq = conv2d<8,40,true>(big, big_w);
+   std::cout << "big_sq raw " << std::dec << int64_t(big_sq.at(0,0,0,0).val) << " (should saturate)" << std::endl;
+   assert(int64_t(big_sq.at(0,0,0,0).val) == (int64_t(1) << 47) - 1);
+   big.at(0,0,0,0).val = -30000;
+   auto big_neg = conv2d<8,40,true>(big, big_w);
+   assert(int64_t(big_neg.at(0,0,0,0).val) == -(int64_t(1) << 47));
+
+   //wide operands: Winograd's transformed sums would overflow an int64_t
+   //where direct does not, so neither Auto nor an explicit Winograd request
+   //may use it
+   {
+      FixedTensor<13,13,true> wide_in(1,16,16,256), wide_w(8,3,3,256);
+      for(auto& e : wide_in.data) e.val = (1 << 25) - 1;
+      for(auto& e : wide_w.data)  e.val = (1 << 25) - 1;
+      Conv2dParams p;
+      p.pad_h = p.pad_w = 1;
+      p.algo = ConvAlgo::Direct;
+      auto wide_direct = conv2d<37,26,true>(wide_in, wide_w, p);
+      p.algo = ConvAlgo::Winograd;
+      auto wide_wino = conv2d<37,26,true>(wide_in, wide_w, p);
+      p.algo = ConvAlgo::Auto;
+      auto wide_auto = conv2d<37,26,true>(wide_in, wide_w, p);
+      std::cout << "wide interior raw " << int64_t(wide_direct.at(0,5,5,0).val) << std::endl;
+      assert(int64_t(wide_direct.at(0,5,5,0).val) == 2304 * int64_t((1 << 25) - 1) * ((1 << 25) - 1));
+      for(std::size_t i = 0; i < wide_direct.size(); ++i){
+         assert(wide_direct.data[i].val == wide_wino.data[i].val);
+         assert(wide_direct.data[i].val == wide_auto.data[i].val);
+      }
+   }
+
+   //bad shapes throw rather than computing garbage
+   bool threw = false;
+   try {
+      //3x3 window, stride 2, over an unpadded 2x2 input does not fit
+      FixedTensor<4,4,true> small(1,2,2,1), k3(1,3,3,1);
+      Conv2dParams p;
+      p.stride_h = p.stride_w = 2;
+      conv2d<8,8,true>(small, k3, p);
+   } catch(const std::invalid_argument& e) {
+      std::cout << "window too large: " << e.what() << std::endl;
+      threw = true;
+   }
+   assert(threw);
+   threw = false;
+   try {
+      FixedTensor<4,4,true> in2(1,4,4,2), k3(1,3,3,3);
+      conv2d<8,8,true>(in2, k3);
+   } catch(const std::invalid_argument& e) {
+      std::cout << "channel mismatch: " << e.what() << std::endl;
+      threw = true;
+   }
+   assert(threw);
+   threw = false;
+   try {
+      FixedTensor<4,4,true> empty_c(1,4,4,0), k0(1,1,1,0);
+      Conv2dParams p;
+      p.algo = ConvAlgo::Im2col;
+      conv2d<8,8,true>(empty_c, k0, p);
+   } catch(const std::invalid_argument& e) {
+      std::cout << "zero channels: " << e.what() << std::endl;
+      threw = true;
+   }
+   assert(threw);
+   threw = false;
+   try {
+      FixedTensor<4,4,true> in4(1,4,4,2), no_k(0,3,3,2);
+      conv2d<8,8,true>(in4, no_k);
+   } catch(const std::invalid_argument& e) {
+      std::cout << "zero output channels: " << e.what() << std::endl;
+      threw = true;
+   }
+   assert(threw);
+
+   std::srand(42);
+   check_shape(1, 7, 9, 3, 4, 3, 3, 1, 1, 1);
+   check_shape(2, 8, 8, 16, 20, 3, 3, 1, 1, 1);
+   check_shape(1, 16, 17, 8, 9, 3, 3, 1, 1, 1);  //Auto picks Winograd
+   check_shape(1, 5, 6, 9, 5, 3, 3, 1, 0, 1);
+   check_shape(1, 6, 5, 40, 7, 3, 3, 1, 1, 1);   //R*S*C > GEMM_KB: several reduction blocks
+   check_shape(1, 9, 9, 8, 6, 3, 3, 2, 1, 1);
+   check_shape(1, 6, 7, 70, 17, 1, 1, 1, 0, 1);
+   check_shape(1, 7, 7, 12, 8, 1, 1, 2, 0, 1);
+   check_shape(1, 11, 11, 4, 6, 5, 5, 1, 2, 1);
+   check_shape(1, 10, 10, 5, 3, 3, 3, 1, 2, 2);
+   check_shape(2, 6, 5, 3, 4, 2, 4, 1, 1, 1);
+   check_shape(1, 3, 3, 2, 2, 3, 3, 1, 0, 1);    //window exactly fits: 1x1 output
+
+   std::cout << "conv tests passed" << std::endl;
+}